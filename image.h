@@ -0,0 +1,105 @@
+/* Library interface for the filters in image.c, for using them from another program.
+        Build image.c with -DIMAGE_MAIN=0 to leave out its main(), and link it in */
+
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* What every function that can fail returns. For anything but IMAGE_OK,
+        image_error_message() has the full message, with the details */
+typedef enum image_error
+{
+    IMAGE_OK = 0,
+    IMAGE_ERROR_IO,             /* A file couldn't be opened, read or written */
+    IMAGE_ERROR_FORMAT,         /* The file isn't an uncompressed 24 bit BMP, or the edits can't be read */
+    IMAGE_ERROR_MEMORY,         /* Memory couldn't be allocated */
+    IMAGE_ERROR_CHAIN,          /* The filter chain can't be read, or can't be run that way */
+    IMAGE_ERROR_THREADS,        /* Threads couldn't be started */
+    IMAGE_ERROR_OPTIONS         /* An option (or the IMAGE_CPU environment variable) isn't valid */
+} image_error;
+
+/* Options for a context. Leaving any of them 0 (or passing NULL for all of them)
+        gives the default */
+typedef struct image_options
+{
+    int num_threads;            /* Threads working on each image, counting the caller. 0 is one per core */
+    const char *cache_dir;      /* Directory to keep every result in (made if it has to be), NULL for none */
+    FILE *log;                  /* Where to print each image done and any errors, NULL for nowhere */
+    int verbose;                /* Print the chain and how long each step took, not just a line per image */
+} image_options;
+
+/* An image in memory: 24 bit pixels (each blue, green, red), rows that are stride bytes
+        apart, and the bottom row first unless top_down is set, just like in a BMP file */
+typedef struct image_pixels
+{
+    int width;
+    int height;
+    int stride;
+    int top_down;
+    uint8_t *data;
+} image_pixels;
+
+/* A context has the thread pool, the buffers that are reused from one image to the next,
+        and the options. Any number of threads can use one context at once, each on its
+        own image. The pool works on one image at a time, and the others run on the
+        threads that called for them. Contexts don't share anything, so each can get
+        its own share of the cores. When image.c is built with USE_NUMA, each one's
+        workers are pinned to cores of their own, but the threads calling in are
+        left where they are */
+typedef struct image_context image_context;
+
+/* A parsed filter chain like "greyscale,gaussian_blur_sigma=2". It isn't changed by
+        being run, so one chain can be used with any context, by any number of threads */
+typedef struct image_chain image_chain;
+
+/* Makes a new context (and starts its threads) in *context */
+image_error image_context_new(const image_options *options, image_context **context);
+
+/* Stops a context's threads and frees it. Nothing can be using it */
+void image_context_free(image_context *context);
+
+/* Parses a filter chain into *chain. Errors are printed to the context's log */
+image_error image_chain_new(image_context *context, const char *spec, image_chain **chain);
+
+/* Frees a filter chain */
+void image_chain_free(image_chain *chain);
+
+/* Returns the name of each filter a chain can have, from index 0 on, and NULL past the last */
+const char* image_filter_name(int index);
+
+/* Reads a BMP file, runs the chain on it, and writes the result to out_name */
+image_error image_process_file(image_context *context, const image_chain *chain, const char *in_name, const char *out_name);
+
+/* Runs the chain on every image named. A name can be a file, a directory (every .bmp in it),
+        @file for a list of names in a file, or - for a list of names on stdin. Each
+        output goes next to its input, with out_ in front of the name. Every image is
+        tried, and the first error is returned if any of them fail */
+image_error image_process_files(image_context *context, const image_chain *chain, int num_names, char **names);
+
+/* Runs the chain on an image in memory, and puts the result in *out (which can be a
+        different size), to be freed with image_pixels_free(). in isn't changed */
+image_error image_process_pixels(image_context *context, const image_chain *chain,
+        const image_pixels *in, image_pixels *out);
+
+/* Frees the data of the pixels from image_process_pixels(), with the same context, before
+        the context is freed */
+void image_pixels_free(image_context *context, image_pixels *pixels);
+
+/* Runs the chain on in_name and writes out_name, then keeps them up to date: each line read
+        from edits lists the rectangles of in_name that changed, as x,y,width,height from
+        the top left, and only what they change is run again and rewritten. Returns at
+        the end of edits */
+image_error image_run_interactive(image_context *context, const image_chain *chain,
+        const char *in_name, const char *out_name, FILE *edits);
+
+/* Times every filter, or the ones in spec if it isn't NULL, and prints the results to the log.
+        It restarts the context's pool with each number of threads, so nothing else can
+        be using the context */
+image_error image_benchmark(image_context *context, const char *spec);
+
+/* Returns the message of the error the last call on this thread returned, or "" if it didn't fail */
+const char* image_error_message(void);
+
+#endif
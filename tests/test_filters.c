@@ -0,0 +1,637 @@
+/* Checks that every filter gives the same image however it's run. Each of test_chains
+        (which between them have to use every filter image.c has) is run on images of awkward sizes at every IMAGE_CPU level this CPU has, and
+        compared with the scalar level, which only uses the plain C convolution.
+        Then each is run with image_run_interactive() on a file, with edits that
+        only mark rectangles, and compared with image_process_file(). Each is also
+        run through a cache, and then through it again after its entries are damaged.
+        Chains with bad params, like NaN, are checked to fail to parse.
+
+        Build from the top of the repo with
+        gcc -Wall -Wextra -Wpedantic -Werror -Ofast -DIMAGE_MAIN=0 -I. -o test_filters tests/test_filters.c image.c -lpthread -lm
+        and run ./test_filters, which prints each mismatch and exits with 1 if there were any */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+#include "image.h"
+
+/* The threads each context gets, more than one so the tiles are split up */
+#define TEST_THREADS 3
+
+/* Every level image.c can have, in order. The ones this CPU (or build) doesn't have are skipped */
+#define TEST_CPU_NAMES {"scalar", "sse2", "sse4.1", "avx2", "avx512", "neon"}
+
+/* Chains image_chain_new() has to turn away. -Ofast makes isfinite() always true, so
+        these check NaN and inf are caught some other way */
+#define TEST_BAD_CHAINS {"brighten=nan", "brighten=inf", "brighten=-inf", "brighten=1e999", \
+        "box_blur_radius=nan", "gaussian_blur_sigma=nan", "downscale=nan", "downscale=infinity", \
+        "thumbnail=0x1p9999", "saturate=", "darken=2x", "invert=1", "no_such_filter"}
+
+/* The edits image_run_interactive() is given, which mark rectangles without changing anything.
+        The one over the whole image goes first, so the later ones are run one region at a time */
+#define TEST_EDITS "0,0,100000,100000\n0,0,1,1\n2,3,5,4 10,1,3,3\n"
+
+/* The ways damage_cache() can damage a cache entry. Each has to be taken as a miss */
+enum test_damage
+{
+    TEST_DAMAGE_SIZE,           /* The header says it's far bigger than it is */
+    TEST_DAMAGE_SHORT,          /* The file is cut short by a byte */
+    TEST_NUM_DAMAGES
+};
+
+/* Struct for the size of an image to test on (16 bytes). Rows are padding bytes longer than they have to be */
+typedef struct test_image
+{
+    int width;
+    int height;
+    int top_down;
+    int padding;
+} test_image;
+
+/* Struct for what a chain made at the scalar level, for the other levels to match (32 bytes) */
+typedef struct test_result
+{
+    image_error error;
+    image_pixels pixels;
+} test_result;
+
+/* Fills an image with noise, with some smooth gradients so the edge detections find something */
+void fill_image(image_pixels *pixels, unsigned seed);
+
+/* Runs every chain on every image at one IMAGE_CPU level. The scalar level's results are
+        kept in results, and the other levels are compared with them.
+        Returns the number of mismatches, or -1 if the CPU doesn't have the level */
+int test_cpu_level(const char *level, image_pixels *inputs, test_result *results);
+
+/* Checks that every filter image_filter_name() gives is a step of one of test_chains,
+        so a new filter can't go untested. Returns the number that aren't */
+int test_coverage(void);
+
+/* Returns 1 if one of a chain's steps is the filter */
+int chain_has_filter(const char *chain, const char *name);
+
+/* Returns 1 if out is the same image as expected, with the same error */
+int same_result(image_error error, image_pixels *out, test_result *expected);
+
+/* Writes an image to a 24 bit BMP file. Returns 0 if it can't */
+int write_bmp(const char *name, image_pixels *pixels);
+
+/* Returns 1 if two files have the same bytes */
+int same_files(const char *name_a, const char *name_b);
+
+/* Checks that each of TEST_BAD_CHAINS fails to parse. Returns the number that didn't */
+int test_bad_chains(void);
+
+/* Runs every chain on every image with image_run_interactive(), and compares the output with
+        image_process_file()'s. Returns the number of mismatches */
+int test_interactive(image_pixels *inputs);
+
+/* Damages every file in a directory in one of the test_damage ways,
+        or just removes them all if how is TEST_NUM_DAMAGES */
+void damage_cache(const char *dir, int how);
+
+/* Runs every chain on every image through a cache: once to fill it, once more to hit it,
+        and once after each way of damaging its entries. Each output has to be the same
+        as image_process_file()'s without a cache. Returns the number of mismatches */
+int test_cache(image_pixels *inputs);
+
+/* The images every chain is run on: a big one with odd sizes so the vector loops have
+        tails, a top down one wide enough for them too (the built in kernels' rows, like
+        emboss's, swap the rows above and below for it), small odd ones both ways up,
+        and ones only a pixel wide or high */
+const test_image test_images[] = {
+    {1003, 517, 0, 0},
+    {331, 61, 1, 2},
+    {37, 23, 0, 5},
+    {29, 17, 1, 0},
+    {1, 1, 0, 0},
+    {1, 40, 0, 3},
+    {40, 1, 1, 0},
+};
+#define NUM_TEST_IMAGES ((int)(sizeof(test_images) / sizeof(*test_images)))
+
+/* The chains every image is run through, a group for each part of image.c they check.
+        Each filter has to be in one of them */
+const char *test_chains[] = {
+    /* The 3x3 kernels, which have hand written vector code */
+    "identity", "box_blur", "gaussian_blur", "sharpen", "emboss",
+    /* Point operations, which are fused into one pass, alone and around a kernel */
+    "greyscale", "invert", "saturate", "desaturate", "brighten", "darken", "set_dim_to_black",
+    "set_bright_to_white", "red_only", "green_only", "blue_only", "swap_r_and_g", "swap_r_and_b",
+    "swap_g_and_b", "saturate=2,sharpen,invert", "brighten=0.7,invert,set_bright_to_white=90",
+    /* Kernels of any radius, and the running sum blurs */
+    "box_blur_radius", "gaussian_blur_sigma", "box_blur_radius=4", "gaussian_blur_sigma=2.3",
+    /* Canny, with the Sobel gradient fused into it */
+    "canny_edge_detection",
+    /* The full Canny pipeline, with suppression and hysteresis */
+    "full_canny_edge_detection",
+    /* The edge detections, which run on one byte per pixel grey images */
+    "simple_edge_detection", "greyscale,canny_edge_detection",
+    /* The filters the command line added, and a chain it rewrites */
+    "sobel", "threshold", "greyscale,gaussian_blur,sobel,threshold=60", "invert,invert,threshold,threshold",
+    /* The resizing filters, with whole and fractional factors */
+    "downscale", "downscale_bilinear", "thumbnail", "pyramid", "downscale=2.5", "downscale=3",
+    "thumbnail=300", "downscale_bilinear=1.5", "pyramid=2",
+    /* The filters that pick their threshold or levels from the histogram */
+    "auto_threshold", "auto_set_dim_to_black", "auto_set_bright_to_white", "auto_levels", "auto_levels=5",
+};
+#define NUM_TEST_CHAINS ((int)(sizeof(test_chains) / sizeof(*test_chains)))
+
+int main(void)
+{
+    const char *levels[] = TEST_CPU_NAMES;
+    int failures = test_coverage();
+
+    image_pixels inputs[NUM_TEST_IMAGES];
+    for (int i = 0; i < NUM_TEST_IMAGES; i++)
+    {
+        const test_image *image = &test_images[i];
+        image_pixels pixels = {image->width, image->height, (image->width * 3 + 3) / 4 * 4 + image->padding,
+                image->top_down, NULL};
+        pixels.data = (uint8_t*)malloc((size_t)pixels.stride * (size_t)pixels.height);
+        if (pixels.data == NULL)
+        {
+            printf("ERROR:  Failed to allocate memory for test image.\n");
+            return EXIT_FAILURE;
+        }
+        fill_image(&pixels, (unsigned)i + 1);
+        inputs[i] = pixels;
+    }
+
+    /* The scalar level goes first, so there's something to compare the rest with */
+    test_result *results = (test_result*)calloc((size_t)NUM_TEST_CHAINS * NUM_TEST_IMAGES, sizeof(test_result));
+    if (results == NULL)
+    {
+        printf("ERROR:  Failed to allocate memory for test results.\n");
+        return EXIT_FAILURE;
+    }
+    for (int level = 0; level < (int)(sizeof(levels) / sizeof(*levels)); level++)
+    {
+        int level_failures = test_cpu_level(levels[level], inputs, results);
+        if (level_failures < 0)
+        {
+            if (level == 0)
+            {
+                printf("ERROR:  Cannot run at the scalar level.\n\t%s", image_error_message());
+                return EXIT_FAILURE;
+            }
+            printf("Skipped %s, which this CPU doesn't have.\n", levels[level]);
+            continue;
+        }
+        printf("Ran %d chains on %d images at %s.\n", NUM_TEST_CHAINS, NUM_TEST_IMAGES, levels[level]);
+        failures += level_failures;
+    }
+    unsetenv("IMAGE_CPU");
+    failures += test_bad_chains();
+    failures += test_interactive(inputs);
+    failures += test_cache(inputs);
+
+    for (int i = 0; i < NUM_TEST_CHAINS * NUM_TEST_IMAGES; i++)
+    {
+        free(results[i].pixels.data);
+    }
+    free(results);
+    for (int i = 0; i < NUM_TEST_IMAGES; i++)
+    {
+        free(inputs[i].data);
+    }
+
+    printf("%s: %d mismatches.\n", (failures == 0) ? "Passed" : "FAILED", failures);
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+void fill_image(image_pixels *pixels, unsigned seed)
+{
+    uint32_t random = 2463534242u * seed;
+    for (int y = 0; y < pixels->height; y++)
+    {
+        uint8_t *row = pixels->data + (size_t)y * (size_t)pixels->stride;
+        for (int x = 0; x < pixels->stride; x++)
+        {
+            /* xorshift32 for the noise */
+            random ^= random << 13;
+            random ^= random >> 17;
+            random ^= random << 5;
+            int gradient = (x * 255) / (pixels->width * 3) + (y * 64) / pixels->height;
+            row[x] = (uint8_t)((gradient + (int)(random % 96)) & 0xFF);
+        }
+    }
+}
+
+int test_cpu_level(const char *level, image_pixels *inputs, test_result *results)
+{
+    /* The level is picked when the first context is made, so each level gets its own */
+    int is_reference = (strcmp(level, "scalar") == 0);
+    image_options options = {TEST_THREADS, NULL, NULL, 0};
+    image_context *context;
+    setenv("IMAGE_CPU", level, 1);
+    if (image_context_new(&options, &context) != IMAGE_OK)
+    {
+        return -1;
+    }
+
+    int failures = 0;
+    for (int c = 0; c < NUM_TEST_CHAINS; c++)
+    {
+        image_chain *chain;
+        if (image_chain_new(context, test_chains[c], &chain) != IMAGE_OK)
+        {
+            printf("FAIL:   %s can't be parsed.\n\t%s", test_chains[c], image_error_message());
+            failures++;
+            continue;
+        }
+        for (int i = 0; i < NUM_TEST_IMAGES; i++)
+        {
+            test_result *expected = &results[c * NUM_TEST_IMAGES + i];
+            image_pixels out;
+            image_error error = image_process_pixels(context, chain, &inputs[i], &out);
+            if (is_reference)
+            {
+                /* The result is kept in memory of its own, since the context goes */
+                expected->error = error;
+                expected->pixels = out;
+                if (error == IMAGE_OK)
+                {
+                    size_t size = (size_t)out.stride * (size_t)out.height;
+                    expected->pixels.data = (uint8_t*)malloc(size);
+                    if (expected->pixels.data != NULL)
+                    {
+                        memcpy(expected->pixels.data, out.data, size);
+                    }
+                }
+            }
+            else if (!same_result(error, &out, expected))
+            {
+                printf("FAIL:   %s on %dx%d%s differs at %s.\n", test_chains[c], inputs[i].width, inputs[i].height,
+                        inputs[i].top_down ? " (top down)" : "", level);
+                failures++;
+            }
+            image_pixels_free(context, &out);
+        }
+        image_chain_free(chain);
+    }
+    image_context_free(context);
+    return failures;
+}
+
+int test_coverage(void)
+{
+    int failures = 0;
+    for (int i = 0; image_filter_name(i) != NULL; i++)
+    {
+        int covered = 0;
+        for (int c = 0; c < NUM_TEST_CHAINS && !covered; c++)
+        {
+            covered = chain_has_filter(test_chains[c], image_filter_name(i));
+        }
+        if (!covered)
+        {
+            printf("FAIL:   %s isn't in any of the test chains.\n", image_filter_name(i));
+            failures++;
+        }
+    }
+    return failures;
+}
+
+int chain_has_filter(const char *chain, const char *name)
+{
+    size_t length = strlen(name);
+    while (*chain != '\0')
+    {
+        size_t step_length = strcspn(chain, ",=");
+        if (step_length == length && strncmp(chain, name, length) == 0)
+        {
+            return 1;
+        }
+        chain += strcspn(chain, ",");
+        if (*chain == ',')
+        {
+            chain++;
+        }
+    }
+    return 0;
+}
+
+int same_result(image_error error, image_pixels *out, test_result *expected)
+{
+    if (error != expected->error)
+    {
+        return 0;
+    }
+    if (error != IMAGE_OK)
+    {
+        return 1;
+    }
+    if (expected->pixels.data == NULL || out->width != expected->pixels.width || out->height != expected->pixels.height
+            || out->top_down != expected->pixels.top_down)
+    {
+        return 0;
+    }
+
+    /* Only the pixels count, not the padding at the end of each row */
+    for (int y = 0; y < out->height; y++)
+    {
+        if (memcmp(out->data + (size_t)y * (size_t)out->stride, expected->pixels.data + (size_t)y * (size_t)expected->pixels.stride,
+                (size_t)out->width * 3) != 0)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int write_bmp(const char *name, image_pixels *pixels)
+{
+    uint8_t header[54] = {'B', 'M'};
+    int stride = (pixels->width * 3 + 3) / 4 * 4;
+    uint32_t data_size = (uint32_t)stride * (uint32_t)pixels->height;
+    uint32_t fields[] = {54 + data_size, 0, 54, 40, (uint32_t)pixels->width,
+            (uint32_t)(pixels->top_down ? -pixels->height : pixels->height)};
+    memcpy(header + 2, fields, sizeof(fields));
+    header[26] = 1;
+    header[28] = 24;
+    memcpy(header + 34, &data_size, sizeof(data_size));
+
+    FILE *file = fopen(name, "wb");
+    if (file == NULL)
+    {
+        return 0;
+    }
+    int written = fwrite(header, 1, sizeof(header), file) == sizeof(header);
+    uint8_t padding[3] = {0, 0, 0};
+    for (int y = 0; y < pixels->height && written; y++)
+    {
+        written = fwrite(pixels->data + (size_t)y * (size_t)pixels->stride, 3, (size_t)pixels->width, file) == (size_t)pixels->width
+                && fwrite(padding, 1, (size_t)(stride - pixels->width * 3), file) == (size_t)(stride - pixels->width * 3);
+    }
+    return (fclose(file) == 0) && written;
+}
+
+int same_files(const char *name_a, const char *name_b)
+{
+    FILE *file_a = fopen(name_a, "rb");
+    FILE *file_b = fopen(name_b, "rb");
+    int same = (file_a != NULL && file_b != NULL);
+    uint8_t block_a[1 << 16], block_b[1 << 16];
+    while (same)
+    {
+        size_t size_a = fread(block_a, 1, sizeof(block_a), file_a);
+        size_t size_b = fread(block_b, 1, sizeof(block_b), file_b);
+        same = (size_a == size_b && memcmp(block_a, block_b, size_a) == 0);
+        if (size_a < sizeof(block_a))
+        {
+            break;
+        }
+    }
+    if (file_a != NULL)
+    {
+        fclose(file_a);
+    }
+    if (file_b != NULL)
+    {
+        fclose(file_b);
+    }
+    return same;
+}
+
+int test_bad_chains(void)
+{
+    const char *bad_chains[] = TEST_BAD_CHAINS;
+    int num_bad_chains = (int)(sizeof(bad_chains) / sizeof(*bad_chains));
+    image_options options = {TEST_THREADS, NULL, NULL, 0};
+    image_context *context;
+    if (image_context_new(&options, &context) != IMAGE_OK)
+    {
+        printf("FAIL:   Cannot make a context.\n\t%s", image_error_message());
+        return 1;
+    }
+    int failures = 0;
+    for (int c = 0; c < num_bad_chains; c++)
+    {
+        image_chain *chain;
+        image_error error = image_chain_new(context, bad_chains[c], &chain);
+        if (error != IMAGE_ERROR_CHAIN)
+        {
+            printf("FAIL:   %s was taken as a chain.\n", bad_chains[c]);
+            failures++;
+            if (error == IMAGE_OK)
+            {
+                image_chain_free(chain);
+            }
+        }
+    }
+    printf("Turned away %d of %d bad chains.\n", num_bad_chains - failures, num_bad_chains);
+    image_context_free(context);
+    return failures;
+}
+
+int test_interactive(image_pixels *inputs)
+{
+    char dir[] = "/tmp/test_filters-XXXXXX";
+    char in_name[64], out_name[64], ref_name[64];
+    if (mkdtemp(dir) == NULL)
+    {
+        printf("FAIL:   Cannot make a directory for interactive mode.\n");
+        return 1;
+    }
+    snprintf(in_name, sizeof(in_name), "%s/in.bmp", dir);
+    snprintf(out_name, sizeof(out_name), "%s/out.bmp", dir);
+    snprintf(ref_name, sizeof(ref_name), "%s/ref.bmp", dir);
+
+    image_options options = {TEST_THREADS, NULL, NULL, 0};
+    image_context *context;
+    if (image_context_new(&options, &context) != IMAGE_OK)
+    {
+        printf("FAIL:   Cannot make a context.\n\t%s", image_error_message());
+        return 1;
+    }
+    int failures = 0, skipped = 0;
+    for (int i = 0; i < NUM_TEST_IMAGES; i++)
+    {
+        if (!write_bmp(in_name, &inputs[i]))
+        {
+            printf("FAIL:   Cannot write %s.\n", in_name);
+            failures++;
+            break;
+        }
+        for (int c = 0; c < NUM_TEST_CHAINS; c++)
+        {
+            image_chain *chain;
+            if (image_chain_new(context, test_chains[c], &chain) != IMAGE_OK)
+            {
+                continue;
+            }
+            FILE *edits = tmpfile();
+            if (edits == NULL || fputs(TEST_EDITS, edits) < 0 || fseek(edits, 0, SEEK_SET) != 0)
+            {
+                printf("FAIL:   Cannot write the edits for interactive mode.\n");
+                failures++;
+            }
+            else
+            {
+                image_error ref_error = image_process_file(context, chain, in_name, ref_name);
+                image_error error = image_run_interactive(context, chain, in_name, out_name, edits);
+                /* Built with DO_STREAM, files can't go through the filters that need the whole
+                        image, but interactive mode keeps the image in memory and still runs them */
+                if (ref_error == IMAGE_ERROR_CHAIN)
+                {
+                    skipped++;
+                }
+                else if (error != ref_error || (error == IMAGE_OK && !same_files(out_name, ref_name)))
+                {
+                    printf("FAIL:   %s on %dx%d%s differs in interactive mode.\n", test_chains[c], inputs[i].width,
+                            inputs[i].height, inputs[i].top_down ? " (top down)" : "");
+                    failures++;
+                }
+            }
+            if (edits != NULL)
+            {
+                fclose(edits);
+            }
+            image_chain_free(chain);
+        }
+    }
+    printf("Ran %d chains on %d images in interactive mode.\n", NUM_TEST_CHAINS, NUM_TEST_IMAGES);
+    if (skipped > 0)
+    {
+        printf("Skipped %d runs of chains that files can't go through in this build.\n", skipped);
+    }
+
+    image_context_free(context);
+    unlink(in_name);
+    unlink(out_name);
+    unlink(ref_name);
+    rmdir(dir);
+    return failures;
+}
+
+void damage_cache(const char *dir, int how)
+{
+    DIR *entries = opendir(dir);
+    if (entries == NULL)
+    {
+        return;
+    }
+    struct dirent *entry;
+    char name[256];
+    while ((entry = readdir(entries)) != NULL)
+    {
+        if (entry->d_name[0] == '.' || snprintf(name, sizeof(name), "%s/%s", dir, entry->d_name) >= (int)sizeof(name))
+        {
+            continue;
+        }
+        if (how == TEST_NUM_DAMAGES)
+        {
+            unlink(name);
+            continue;
+        }
+        int fd = open(name, O_RDWR);
+        if (fd < 0)
+        {
+            continue;
+        }
+        if (how == TEST_DAMAGE_SIZE)
+        {
+            int32_t size[2] = {100000000, 100000};
+            if (pwrite(fd, size, sizeof(size), 18) != (ssize_t)sizeof(size))
+            {
+                printf("FAIL:   Cannot damage %s.\n", name);
+            }
+        }
+        else
+        {
+            off_t length = lseek(fd, 0, SEEK_END);
+            if (length <= 0 || ftruncate(fd, length - 1) != 0)
+            {
+                printf("FAIL:   Cannot damage %s.\n", name);
+            }
+        }
+        close(fd);
+    }
+    closedir(entries);
+}
+
+int test_cache(image_pixels *inputs)
+{
+    const char *run_names[2 + TEST_NUM_DAMAGES] = {"storing", "hit", "too big", "cut short"};
+    char dir[] = "/tmp/test_filters-XXXXXX";
+    char cache_dir[64], in_name[64], out_name[64], ref_name[64];
+    if (mkdtemp(dir) == NULL)
+    {
+        printf("FAIL:   Cannot make a directory for the cache.\n");
+        return 1;
+    }
+    snprintf(cache_dir, sizeof(cache_dir), "%s/cache", dir);
+    snprintf(in_name, sizeof(in_name), "%s/in.bmp", dir);
+    snprintf(out_name, sizeof(out_name), "%s/out.bmp", dir);
+    snprintf(ref_name, sizeof(ref_name), "%s/ref.bmp", dir);
+
+    image_options options = {TEST_THREADS, NULL, NULL, 0};
+    image_options cache_options = {TEST_THREADS, cache_dir, NULL, 0};
+    image_context *context, *cache_context;
+    if (image_context_new(&options, &context) != IMAGE_OK)
+    {
+        printf("FAIL:   Cannot make a context.\n\t%s", image_error_message());
+        return 1;
+    }
+    if (image_context_new(&cache_options, &cache_context) != IMAGE_OK)
+    {
+        printf("FAIL:   Cannot make a context with a cache.\n\t%s", image_error_message());
+        image_context_free(context);
+        return 1;
+    }
+    int failures = 0;
+    for (int i = 0; i < NUM_TEST_IMAGES; i++)
+    {
+        if (!write_bmp(in_name, &inputs[i]))
+        {
+            printf("FAIL:   Cannot write %s.\n", in_name);
+            failures++;
+            break;
+        }
+        for (int c = 0; c < NUM_TEST_CHAINS; c++)
+        {
+            image_chain *chain;
+            if (image_chain_new(context, test_chains[c], &chain) != IMAGE_OK)
+            {
+                continue;
+            }
+
+            /* Each chain starts from an empty cache, so it only finds its own entries */
+            damage_cache(cache_dir, TEST_NUM_DAMAGES);
+            image_error ref_error = image_process_file(context, chain, in_name, ref_name);
+            for (int run = 0; run < 2 + TEST_NUM_DAMAGES && ref_error == IMAGE_OK; run++)
+            {
+                if (run >= 2)
+                {
+                    damage_cache(cache_dir, run - 2);
+                }
+                image_error error = image_process_file(cache_context, chain, in_name, out_name);
+                if (error != IMAGE_OK || !same_files(out_name, ref_name))
+                {
+                    printf("FAIL:   %s on %dx%d%s differs with the cache (%s).\n", test_chains[c], inputs[i].width,
+                            inputs[i].height, inputs[i].top_down ? " (top down)" : "", run_names[run]);
+                    failures++;
+                    break;
+                }
+            }
+            image_chain_free(chain);
+        }
+    }
+    printf("Ran %d chains on %d images through a cache.\n", NUM_TEST_CHAINS, NUM_TEST_IMAGES);
+
+    image_context_free(cache_context);
+    image_context_free(context);
+    damage_cache(cache_dir, TEST_NUM_DAMAGES);
+    rmdir(cache_dir);
+    unlink(in_name);
+    unlink(out_name);
+    unlink(ref_name);
+    rmdir(dir);
+    return failures;
+}